@@ -1,7 +1,19 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "moonbit.h"
 
 void *mbt_retain(void *obj) {
@@ -17,9 +29,27 @@ typedef struct mbt_thread {
   int joined;
 } mbt_thread;
 
+typedef struct mbt_spawn_opts {
+  size_t stack_size;
+  const char *name;
+  int policy;
+  int priority;
+  int has_nice;
+  int nice;
+  const int32_t *cpus;
+  int32_t ncpus;
+} mbt_spawn_opts;
+
 typedef struct mbt_spawn_args {
   void *(*callback)(void *);
   void *data;
+  char name[16];
+  int has_nice;
+  int nice;
+#ifdef __linux__
+  int has_cpus;
+  cpu_set_t cpus;
+#endif
 } mbt_spawn_args;
 
 static void mbt_thread_finalize(void *self) {
@@ -32,6 +62,18 @@ static void mbt_thread_finalize(void *self) {
 
 static void *mbt_thread_trampoline(void *arg) {
   mbt_spawn_args *a = (mbt_spawn_args *)arg;
+#ifdef __linux__
+  if (a->name[0]) {
+    pthread_setname_np(pthread_self(), a->name);
+  }
+  if (a->has_nice) {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), a->nice);
+  }
+  // Best effort: a CPU excluded by the cpuset/cgroup leaves the thread unpinned.
+  if (a->has_cpus) {
+    pthread_setaffinity_np(pthread_self(), sizeof(a->cpus), &a->cpus);
+  }
+#endif
   void *data = a->data;
   void *(*callback)(void *) = a->callback;
   void *res = callback(data);
@@ -42,7 +84,58 @@ static void *mbt_thread_trampoline(void *arg) {
   return res;
 }
 
-void *mbt_mthread_spawn(void *(*callback)(void *), void *data) {
+static int mbt_sched_policy(int32_t code) {
+  switch (code) {
+  case 0:
+    return SCHED_OTHER;
+#ifdef __linux__
+  case 1:
+    return SCHED_BATCH;
+  case 2:
+    return SCHED_IDLE;
+#endif
+  case 3:
+    return SCHED_FIFO;
+  case 4:
+    return SCHED_RR;
+  default:
+    return -1;
+  }
+}
+
+static int mbt_spawn_attr_init(pthread_attr_t *attr, const mbt_spawn_opts *opts) {
+  if (pthread_attr_init(attr) != 0) {
+    return 0;
+  }
+  if (opts->stack_size > 0) {
+    size_t size = opts->stack_size;
+    if (size < (size_t)PTHREAD_STACK_MIN) {
+      size = (size_t)PTHREAD_STACK_MIN;
+    }
+    if (pthread_attr_setstacksize(attr, size) != 0) {
+      pthread_attr_destroy(attr);
+      return 0;
+    }
+  }
+  if (opts->policy >= 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = opts->priority;
+    if (pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+        pthread_attr_setschedpolicy(attr, opts->policy) != 0 ||
+        pthread_attr_setschedparam(attr, &param) != 0) {
+      pthread_attr_destroy(attr);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void *mbt_mthread_spawn_opts(
+  void *(*callback)(void *),
+  void *data,
+  const mbt_spawn_opts *opts
+) {
   mbt_thread *th = (mbt_thread *)moonbit_make_external_object(
     mbt_thread_finalize, sizeof(mbt_thread)
   );
@@ -63,7 +156,40 @@ void *mbt_mthread_spawn(void *(*callback)(void *), void *data) {
   }
   a->callback = callback;
   a->data = data;
-  int rc = pthread_create(&th->t, NULL, mbt_thread_trampoline, a);
+  a->name[0] = '\0';
+  if (opts && opts->name) {
+    strncpy(a->name, opts->name, sizeof(a->name) - 1);
+    a->name[sizeof(a->name) - 1] = '\0';
+  }
+  a->has_nice = opts ? opts->has_nice : 0;
+  a->nice = opts ? opts->nice : 0;
+#ifdef __linux__
+  CPU_ZERO(&a->cpus);
+  if (opts) {
+    for (int32_t i = 0; i < opts->ncpus; i++) {
+      if (opts->cpus[i] >= 0 && opts->cpus[i] < CPU_SETSIZE) {
+        CPU_SET(opts->cpus[i], &a->cpus);
+      }
+    }
+  }
+  a->has_cpus = CPU_COUNT(&a->cpus) > 0;
+#endif
+  pthread_attr_t attr;
+  int has_attr = 0;
+  if (opts) {
+    if (!mbt_spawn_attr_init(&attr, opts)) {
+      free(a);
+      if (data) {
+        moonbit_decref(data);
+      }
+      return th;
+    }
+    has_attr = 1;
+  }
+  int rc = pthread_create(&th->t, has_attr ? &attr : NULL, mbt_thread_trampoline, a);
+  if (has_attr) {
+    pthread_attr_destroy(&attr);
+  }
   if (rc != 0) {
     free(a);
     if (data) {
@@ -76,6 +202,10 @@ void *mbt_mthread_spawn(void *(*callback)(void *), void *data) {
   return th;
 }
 
+void *mbt_mthread_spawn(void *(*callback)(void *), void *data) {
+  return mbt_mthread_spawn_opts(callback, data, NULL);
+}
+
 int32_t mbt_mthread_spawn2(void *(*callback)(void *), void *data, void **out_box) {
   if (!out_box) {
     if (data) {
@@ -88,6 +218,39 @@ int32_t mbt_mthread_spawn2(void *(*callback)(void *), void *data, void **out_box
   return th && th->started;
 }
 
+int32_t mbt_mthread_spawn3(
+  void *(*callback)(void *),
+  void *data,
+  void **out_box,
+  int32_t stack_size,
+  uint8_t *name,
+  int32_t policy,
+  int32_t priority,
+  int32_t has_nice,
+  int32_t nice,
+  int32_t *cpus,
+  int32_t ncpus
+) {
+  if (!out_box) {
+    if (data) {
+      moonbit_decref(data);
+    }
+    return 0;
+  }
+  mbt_spawn_opts opts;
+  opts.stack_size = stack_size > 0 ? (size_t)stack_size : 0;
+  opts.name = (const char *)name;
+  opts.policy = mbt_sched_policy(policy);
+  opts.priority = priority;
+  opts.has_nice = has_nice;
+  opts.nice = nice;
+  opts.cpus = cpus;
+  opts.ncpus = ncpus;
+  mbt_thread *th = (mbt_thread *)mbt_mthread_spawn_opts(callback, data, &opts);
+  out_box[0] = th;
+  return th && th->started;
+}
+
 int32_t mbt_mthread_join(void *tid_ptr, void **res_box) {
   mbt_thread *th = (mbt_thread *)tid_ptr;
   if (!th || !res_box) {
@@ -110,6 +273,16 @@ int32_t mbt_mthread_join(void *tid_ptr, void **res_box) {
   return 0;
 }
 
+int32_t mbt_mthread_detach(void *tid_ptr) {
+  mbt_thread *th = (mbt_thread *)tid_ptr;
+  if (!th || !th->started || th->joined) {
+    return 0;
+  }
+  pthread_detach(th->t);
+  th->joined = 1;
+  return 0;
+}
+
 void *mbt_mutex_new() {
   pthread_mutex_t *lock = malloc(sizeof(pthread_mutex_t));
   pthread_mutex_init(lock, NULL);
@@ -662,3 +835,1599 @@ int32_t mbt_bcast_sender_drop(void *bcast) {
   }
   return 0;
 }
+
+#ifdef __APPLE__
+#define MBT_CLOCK CLOCK_REALTIME
+#else
+#define MBT_CLOCK CLOCK_MONOTONIC
+#endif
+
+static int64_t mbt_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(MBT_CLOCK, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+static void mbt_cond_init_clock(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#ifndef __APPLE__
+  pthread_condattr_setclock(&attr, MBT_CLOCK);
+#endif
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static struct timespec mbt_ns_to_timespec(int64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)(ns / 1000000000LL);
+  ts.tv_nsec = (long)(ns % 1000000000LL);
+  return ts;
+}
+
+#define MBT_JOBQ_LEVELS 3
+
+enum { MBT_WORKER_IDLE = 0, MBT_WORKER_RUNNING = 1, MBT_WORKER_EXITED = 2 };
+
+// Max consecutive LIFO-slot jobs before a worker goes back to the shared queue.
+#define MBT_LIFO_LIMIT 3
+// How long an idle worker leaves another worker's LIFO slot alone before stealing it.
+#define MBT_LIFO_STEAL_GRACE_NS 50000LL
+
+// Histogram buckets are powers of two in microseconds: bucket 0 is < 1us,
+// bucket k is [2^(k-1), 2^k) us and the last bucket is open-ended.
+#define MBT_HIST_BUCKETS 24
+
+// Mostly written by its own worker; aligned so workers don't share cache lines.
+typedef struct mbt_jobq_worker {
+  _Alignas(64) atomic_int state;
+  atomic_llong completed;
+  _Atomic(void *) slot;
+  atomic_llong slot_stamp;
+  int32_t lifo_streak;
+  int64_t started_ns;
+  atomic_llong steals;
+  atomic_llong wait_hist[MBT_HIST_BUCKETS];
+  atomic_llong exec_hist[MBT_HIST_BUCKETS];
+  // Timer tag of the job being run (0: not a periodic tick), see `tags`.
+  int64_t current_tag;
+} mbt_jobq_worker;
+
+static int mbt_hist_bucket(int64_t ns) {
+  int64_t us = ns / 1000;
+  int b = 0;
+  while (us > 0 && b < MBT_HIST_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+static __thread void *mbt_tls_jobq = NULL;
+static __thread int32_t mbt_tls_worker = -1;
+
+typedef struct mbt_timerq mbt_timerq;
+typedef struct mbt_tuner mbt_tuner;
+static void mbt_tuners_free(mbt_tuner *t);
+static void mbt_timerq_tick_done(mbt_timerq *tq, int64_t tag);
+static void mbt_timerq_release(mbt_timerq *tq);
+
+typedef struct mbt_jobq {
+  pthread_mutex_t mu;
+  pthread_cond_t can_send;
+  pthread_cond_t can_recv;
+  pthread_cond_t worker_exited;
+  int destroyed;
+  int closed;
+  int senders;
+  int receivers;
+  int32_t starve_limit;
+  int32_t worker_n;
+  int32_t live_workers;
+  mbt_jobq_worker *workers;
+  int64_t capacity;
+  int64_t len[MBT_JOBQ_LEVELS];
+  int64_t head[MBT_JOBQ_LEVELS];
+  int64_t tail[MBT_JOBQ_LEVELS];
+  int32_t skipped[MBT_JOBQ_LEVELS];
+  void **buf[MBT_JOBQ_LEVELS];
+  int64_t *stamps[MBT_JOBQ_LEVELS];
+  // Per queued job: the timer slot and generation of a periodic tick, so the
+  // worker that runs it can hand the slot back in O(1); 0 for other jobs.
+  int64_t *tags[MBT_JOBQ_LEVELS];
+  int lifo;
+  int metrics;
+  int64_t submitted;
+  mbt_timerq *timers;
+  // Chunk tuners of `ParConfig::auto` configs made for this pool.
+  mbt_tuner *tuners;
+} mbt_jobq;
+
+static int64_t mbt_jobq_total_locked(mbt_jobq *q) {
+  int64_t n = 0;
+  for (int l = 0; l < MBT_JOBQ_LEVELS; l++) {
+    n += q->len[l];
+  }
+  return n;
+}
+
+static int64_t mbt_jobq_slots_used(mbt_jobq *q) {
+  int64_t n = 0;
+  for (int32_t i = 0; i < q->worker_n; i++) {
+    if (atomic_load_explicit(&q->workers[i].slot, memory_order_relaxed)) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static void mbt_jobq_drop_messages(mbt_jobq *q) {
+  for (int l = 0; l < MBT_JOBQ_LEVELS; l++) {
+    while (q->buf[l] && q->len[l] > 0) {
+      void *msg = q->buf[l][q->head[l]];
+      q->buf[l][q->head[l]] = NULL;
+      q->head[l] = (q->head[l] + 1) % q->capacity;
+      q->len[l]--;
+      if (msg) {
+        moonbit_decref(msg);
+      }
+    }
+    q->len[l] = 0;
+    q->head[l] = 0;
+    q->tail[l] = 0;
+  }
+  for (int32_t i = 0; i < q->worker_n; i++) {
+    void *msg = atomic_exchange_explicit(&q->workers[i].slot, NULL, memory_order_acquire);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+  }
+}
+
+static void mbt_jobq_destroy(mbt_jobq *q) {
+  pthread_mutex_lock(&q->mu);
+  if (q->destroyed) {
+    pthread_mutex_unlock(&q->mu);
+    return;
+  }
+  q->destroyed = 1;
+  q->closed = 1;
+  mbt_jobq_drop_messages(q);
+  pthread_cond_broadcast(&q->can_send);
+  pthread_cond_broadcast(&q->can_recv);
+  pthread_mutex_unlock(&q->mu);
+
+  for (int l = 0; l < MBT_JOBQ_LEVELS; l++) {
+    free(q->buf[l]);
+    free(q->stamps[l]);
+    free(q->tags[l]);
+  }
+  free(q->workers);
+  if (q->timers) {
+    mbt_timerq_release(q->timers);
+  }
+  mbt_tuners_free(q->tuners);
+  pthread_cond_destroy(&q->can_send);
+  pthread_cond_destroy(&q->can_recv);
+  pthread_cond_destroy(&q->worker_exited);
+  pthread_mutex_destroy(&q->mu);
+  free(q);
+}
+
+void *mbt_jobq_new(
+  int32_t capacity,
+  int32_t starve_limit,
+  int32_t worker_n,
+  int32_t lifo,
+  int32_t metrics
+) {
+  if (capacity <= 0) {
+    capacity = 1;
+  }
+  if (worker_n < 0) {
+    worker_n = 0;
+  }
+  mbt_jobq *q = (mbt_jobq *)calloc(1, sizeof(mbt_jobq));
+  if (!q) {
+    return NULL;
+  }
+  size_t workers_size = (size_t)(worker_n > 0 ? worker_n : 1) * sizeof(mbt_jobq_worker);
+  q->workers = (mbt_jobq_worker *)aligned_alloc(64, workers_size);
+  if (!q->workers) {
+    free(q);
+    return NULL;
+  }
+  memset(q->workers, 0, workers_size);
+  for (int32_t i = 0; i < worker_n; i++) {
+    atomic_init(&q->workers[i].state, MBT_WORKER_IDLE);
+    atomic_init(&q->workers[i].completed, 0);
+    atomic_init(&q->workers[i].slot, NULL);
+    q->workers[i].lifo_streak = 0;
+  }
+  q->lifo = lifo;
+  q->metrics = metrics;
+  q->worker_n = worker_n;
+  q->live_workers = worker_n;
+  for (int l = 0; l < MBT_JOBQ_LEVELS; l++) {
+    q->buf[l] = (void **)calloc((size_t)capacity, sizeof(void *));
+    q->tags[l] = (int64_t *)calloc((size_t)capacity, sizeof(int64_t));
+    if (metrics) {
+      q->stamps[l] = (int64_t *)calloc((size_t)capacity, sizeof(int64_t));
+    }
+    if (!q->buf[l] || !q->tags[l] || (metrics && !q->stamps[l])) {
+      for (int k = 0; k <= l; k++) {
+        free(q->buf[k]);
+        free(q->stamps[k]);
+        free(q->tags[k]);
+      }
+      free(q->workers);
+      free(q);
+      return NULL;
+    }
+  }
+  pthread_mutex_init(&q->mu, NULL);
+  pthread_cond_init(&q->can_send, NULL);
+  mbt_cond_init_clock(&q->can_recv);
+  mbt_cond_init_clock(&q->worker_exited);
+  q->senders = 1;
+  q->receivers = 1;
+  q->capacity = capacity;
+  q->starve_limit = starve_limit <= 0 ? 1 : starve_limit;
+  return q;
+}
+
+int32_t mbt_jobq_new2(
+  int32_t capacity,
+  int32_t starve_limit,
+  int32_t worker_n,
+  int32_t lifo,
+  int32_t metrics,
+  void **out_box
+) {
+  if (!out_box) {
+    return 0;
+  }
+  void *q = mbt_jobq_new(capacity, starve_limit, worker_n, lifo, metrics);
+  out_box[0] = q;
+  return q != NULL;
+}
+
+int32_t mbt_jobq_receiver_clone(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  if (!q->destroyed) {
+    q->receivers++;
+  }
+  pthread_mutex_unlock(&q->mu);
+  return 0;
+}
+
+int32_t mbt_jobq_close(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  if (!q->destroyed) {
+    q->closed = 1;
+    pthread_cond_broadcast(&q->can_send);
+    pthread_cond_broadcast(&q->can_recv);
+  }
+  pthread_mutex_unlock(&q->mu);
+  return 0;
+}
+
+// `stamp` is the enqueue time kept for queue-wait metrics (0: now). Jobs
+// displaced from a LIFO slot keep their original stamp and are not counted
+// as submitted twice. The caller holds `mu` and has made room.
+static void mbt_jobq_enqueue_locked(
+  mbt_jobq *q,
+  int32_t level,
+  void *msg,
+  int64_t stamp,
+  int64_t tag
+) {
+  q->buf[level][q->tail[level]] = msg;
+  q->tags[level][q->tail[level]] = tag;
+  if (q->metrics) {
+    q->stamps[level][q->tail[level]] = stamp ? stamp : mbt_now_ns();
+  }
+  q->tail[level] = (q->tail[level] + 1) % q->capacity;
+  q->len[level]++;
+  if (!stamp) {
+    q->submitted++;
+  }
+  pthread_cond_signal(&q->can_recv);
+}
+
+static int32_t mbt_jobq_push(
+  mbt_jobq *q,
+  int32_t level,
+  void *msg,
+  int64_t stamp,
+  int64_t tag
+) {
+  pthread_mutex_lock(&q->mu);
+  while (!q->destroyed && !q->closed && q->receivers > 0 && q->len[level] == q->capacity) {
+    pthread_cond_wait(&q->can_send, &q->mu);
+  }
+  if (q->destroyed || q->closed || q->receivers == 0) {
+    pthread_mutex_unlock(&q->mu);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  mbt_jobq_enqueue_locked(q, level, msg, stamp, tag);
+  pthread_mutex_unlock(&q->mu);
+  return 1;
+}
+
+int32_t mbt_jobq_send(void *queue, int32_t level, void *msg) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || level < 0 || level >= MBT_JOBQ_LEVELS) {
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  int32_t w = mbt_tls_worker;
+  if (q->lifo && level == 1 && mbt_tls_jobq == q && w >= 0 && w < q->worker_n) {
+    // Submitted from one of our own workers: park it in that worker's LIFO
+    // slot so it runs next on the same core; the previous occupant moves to
+    // the shared queue.
+    pthread_mutex_lock(&q->mu);
+    if (q->destroyed || q->closed || q->receivers == 0) {
+      pthread_mutex_unlock(&q->mu);
+      if (msg) {
+        moonbit_decref(msg);
+      }
+      return 0;
+    }
+    mbt_jobq_worker *self = &q->workers[w];
+    int64_t prev_stamp = 1;
+    if (q->metrics) {
+      prev_stamp = atomic_load_explicit(&self->slot_stamp, memory_order_relaxed);
+      atomic_store_explicit(&self->slot_stamp, mbt_now_ns(), memory_order_relaxed);
+    }
+    void *prev = atomic_exchange_explicit(&self->slot, msg, memory_order_acq_rel);
+    q->submitted++;
+    pthread_cond_signal(&q->can_recv);
+    if (prev) {
+      // `prev` was already accepted, so it moves to the shared queue under
+      // the same lock and regardless of `closed`: a close racing with this
+      // send must not drop it. It is lost only if no worker is left to run it.
+      while (!q->destroyed && q->receivers > 0 && q->len[level] == q->capacity) {
+        pthread_cond_wait(&q->can_send, &q->mu);
+      }
+      if (!q->destroyed && q->receivers > 0) {
+        mbt_jobq_enqueue_locked(q, level, prev, prev_stamp, 0);
+        prev = NULL;
+      }
+    }
+    pthread_mutex_unlock(&q->mu);
+    if (prev) {
+      moonbit_decref(prev);
+    }
+    return 1;
+  }
+  return mbt_jobq_push(q, level, msg, 0, 0);
+}
+
+// Like `mbt_jobq_send`, but always queues on the shared queue, even from one
+// of our own workers, and never blocks: fails if `level` is full. For jobs
+// another (idle) worker should pick up now, and that the sender can just as
+// well run itself when the queue has no room.
+int32_t mbt_jobq_try_send_shared(void *queue, int32_t level, void *msg) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || level < 0 || level >= MBT_JOBQ_LEVELS) {
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  if (q->destroyed || q->closed || q->receivers == 0 || q->len[level] == q->capacity) {
+    pthread_mutex_unlock(&q->mu);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  mbt_jobq_enqueue_locked(q, level, msg, 0, 0);
+  pthread_mutex_unlock(&q->mu);
+  return 1;
+}
+
+int32_t mbt_jobq_worker_enter(void *queue, int32_t worker) {
+  mbt_tls_jobq = queue;
+  mbt_tls_worker = worker;
+  return 0;
+}
+
+// Highest non-empty level wins, unless a lower level has been passed over
+// `starve_limit` times in a row; the most starved (lowest) such level goes first.
+static int mbt_jobq_pick_locked(mbt_jobq *q) {
+  int pick = -1;
+  for (int l = MBT_JOBQ_LEVELS - 1; l > 0; l--) {
+    if (q->len[l] > 0 && q->skipped[l] >= q->starve_limit) {
+      pick = l;
+      break;
+    }
+  }
+  if (pick < 0) {
+    for (int l = 0; l < MBT_JOBQ_LEVELS; l++) {
+      if (q->len[l] > 0) {
+        pick = l;
+        break;
+      }
+    }
+  }
+  if (pick < 0) {
+    return -1;
+  }
+  for (int l = pick + 1; l < MBT_JOBQ_LEVELS; l++) {
+    if (q->len[l] > 0) {
+      q->skipped[l]++;
+    }
+  }
+  q->skipped[pick] = 0;
+  return pick;
+}
+
+static void *mbt_jobq_pop_locked(mbt_jobq *q, int l, int64_t *stamp, int64_t *tag) {
+  void *msg = q->buf[l][q->head[l]];
+  *stamp = q->metrics ? q->stamps[l][q->head[l]] : 0;
+  *tag = q->tags[l][q->head[l]];
+  q->buf[l][q->head[l]] = NULL;
+  q->head[l] = (q->head[l] + 1) % q->capacity;
+  q->len[l]--;
+  pthread_cond_broadcast(&q->can_send);
+  return msg;
+}
+
+// Order: own LIFO slot (at most MBT_LIFO_LIMIT times in a row), shared
+// queue, own slot, then other workers' slots after a short grace period.
+int32_t mbt_jobq_recv(void *queue, int32_t worker, void **out_box) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  mbt_jobq_worker *self = (worker >= 0 && worker < q->worker_n) ? &q->workers[worker] : NULL;
+  void *msg = NULL;
+  int64_t stamp = 0;
+  int64_t tag = 0;
+  int waited = 0;
+  pthread_mutex_lock(&q->mu);
+  for (;;) {
+    if (q->destroyed) {
+      break;
+    }
+    if (self && self->lifo_streak < MBT_LIFO_LIMIT) {
+      msg = atomic_exchange_explicit(&self->slot, NULL, memory_order_acq_rel);
+      if (msg) {
+        stamp = atomic_load_explicit(&self->slot_stamp, memory_order_relaxed);
+        self->lifo_streak++;
+        break;
+      }
+    }
+    int l = mbt_jobq_pick_locked(q);
+    if (l >= 0) {
+      msg = mbt_jobq_pop_locked(q, l, &stamp, &tag);
+      if (self) {
+        self->lifo_streak = 0;
+      }
+      break;
+    }
+    if (self) {
+      msg = atomic_exchange_explicit(&self->slot, NULL, memory_order_acq_rel);
+      if (msg) {
+        stamp = atomic_load_explicit(&self->slot_stamp, memory_order_relaxed);
+        self->lifo_streak = 1;
+        break;
+      }
+      if (mbt_jobq_slots_used(q) > 0) {
+        if (!waited) {
+          waited = 1;
+          struct timespec until = mbt_ns_to_timespec(mbt_now_ns() + MBT_LIFO_STEAL_GRACE_NS);
+          pthread_cond_timedwait(&q->can_recv, &q->mu, &until);
+          continue;
+        }
+        for (int32_t i = 0; i < q->worker_n && !msg; i++) {
+          if (i != worker) {
+            msg = atomic_exchange_explicit(&q->workers[i].slot, NULL, memory_order_acq_rel);
+            stamp = atomic_load_explicit(&q->workers[i].slot_stamp, memory_order_relaxed);
+          }
+        }
+        if (msg) {
+          atomic_fetch_add_explicit(&self->steals, 1, memory_order_relaxed);
+          break;
+        }
+      }
+    }
+    if (q->closed) {
+      break;
+    }
+    pthread_cond_wait(&q->can_recv, &q->mu);
+    waited = 0;
+  }
+  if (msg && self) {
+    atomic_store_explicit(&self->state, MBT_WORKER_RUNNING, memory_order_relaxed);
+    self->current_tag = tag;
+  }
+  pthread_mutex_unlock(&q->mu);
+  if (msg && self && q->metrics) {
+    self->started_ns = mbt_now_ns();
+    int b = mbt_hist_bucket(self->started_ns - stamp);
+    atomic_fetch_add_explicit(&self->wait_hist[b], 1, memory_order_relaxed);
+  }
+  if (!msg) {
+    return 0;
+  }
+  out_box[0] = msg;
+  return 1;
+}
+
+int32_t mbt_jobq_done(void *queue, int32_t worker) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || worker < 0 || worker >= q->worker_n) {
+    return 0;
+  }
+  mbt_jobq_worker *w = &q->workers[worker];
+  if (q->metrics) {
+    int b = mbt_hist_bucket(mbt_now_ns() - w->started_ns);
+    atomic_fetch_add_explicit(&w->exec_hist[b], 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&w->completed, 1, memory_order_relaxed);
+  int64_t tag = w->current_tag;
+  w->current_tag = 0;
+  if (tag && q->timers) {
+    mbt_timerq_tick_done(q->timers, tag);
+  }
+  atomic_store_explicit(&w->state, MBT_WORKER_IDLE, memory_order_release);
+  return 0;
+}
+
+int32_t mbt_jobq_worker_exit(void *queue, int32_t worker) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || worker < 0 || worker >= q->worker_n) {
+    return 0;
+  }
+  if (mbt_tls_jobq == q) {
+    mbt_tls_jobq = NULL;
+    mbt_tls_worker = -1;
+  }
+  pthread_mutex_lock(&q->mu);
+  atomic_store_explicit(&q->workers[worker].state, MBT_WORKER_EXITED, memory_order_release);
+  q->live_workers--;
+  pthread_cond_broadcast(&q->worker_exited);
+  pthread_mutex_unlock(&q->mu);
+  return 0;
+}
+
+int32_t mbt_jobq_worker_state(void *queue, int32_t worker) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || worker < 0 || worker >= q->worker_n) {
+    return MBT_WORKER_EXITED;
+  }
+  return atomic_load_explicit(&q->workers[worker].state, memory_order_acquire);
+}
+
+// Lock-free hint: workers currently waiting for a job.
+int32_t mbt_jobq_idle_workers(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  int32_t n = 0;
+  for (int32_t i = 0; i < q->worker_n; i++) {
+    if (atomic_load_explicit(&q->workers[i].state, memory_order_relaxed) == MBT_WORKER_IDLE) {
+      n++;
+    }
+  }
+  return n;
+}
+
+int64_t mbt_jobq_completed(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  int64_t n = 0;
+  for (int32_t i = 0; i < q->worker_n; i++) {
+    n += atomic_load_explicit(&q->workers[i].completed, memory_order_relaxed);
+  }
+  return n;
+}
+
+// Layout of the snapshot written by mbt_jobq_metrics.
+enum {
+  MBT_METRIC_DEPTH,
+  MBT_METRIC_BUSY,
+  MBT_METRIC_IDLE,
+  MBT_METRIC_SUBMITTED,
+  MBT_METRIC_COMPLETED,
+  MBT_METRIC_STEALS,
+  MBT_METRIC_WAIT_HIST,
+  MBT_METRIC_EXEC_HIST = MBT_METRIC_WAIT_HIST + MBT_HIST_BUCKETS,
+  MBT_METRIC_LEN = MBT_METRIC_EXEC_HIST + MBT_HIST_BUCKETS,
+};
+
+int32_t mbt_jobq_hist_buckets(void) {
+  return MBT_HIST_BUCKETS;
+}
+
+// Fills `out` (at least MBT_METRIC_LEN entries) with a snapshot. Per-worker
+// counters are summed here, so workers never contend on them. Returns 0 if
+// the queue was created without metrics.
+int32_t mbt_jobq_metrics(void *queue, int64_t *out, int32_t cap) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q || !q->metrics || !out || cap < MBT_METRIC_LEN) {
+    return 0;
+  }
+  memset(out, 0, sizeof(int64_t) * MBT_METRIC_LEN);
+  pthread_mutex_lock(&q->mu);
+  if (!q->destroyed) {
+    out[MBT_METRIC_DEPTH] = mbt_jobq_total_locked(q) + mbt_jobq_slots_used(q);
+  }
+  out[MBT_METRIC_SUBMITTED] = q->submitted;
+  pthread_mutex_unlock(&q->mu);
+  for (int32_t i = 0; i < q->worker_n; i++) {
+    mbt_jobq_worker *w = &q->workers[i];
+    int state = atomic_load_explicit(&w->state, memory_order_acquire);
+    if (state == MBT_WORKER_RUNNING) {
+      out[MBT_METRIC_BUSY]++;
+    } else if (state == MBT_WORKER_IDLE) {
+      out[MBT_METRIC_IDLE]++;
+    }
+    out[MBT_METRIC_COMPLETED] += atomic_load_explicit(&w->completed, memory_order_relaxed);
+    out[MBT_METRIC_STEALS] += atomic_load_explicit(&w->steals, memory_order_relaxed);
+    for (int b = 0; b < MBT_HIST_BUCKETS; b++) {
+      out[MBT_METRIC_WAIT_HIST + b] += atomic_load_explicit(&w->wait_hist[b], memory_order_relaxed);
+      out[MBT_METRIC_EXEC_HIST + b] += atomic_load_explicit(&w->exec_hist[b], memory_order_relaxed);
+    }
+  }
+  return 1;
+}
+
+// Waits until every worker has exited or `timeout_ms` passed (< 0 waits
+// forever). Returns the number of workers still alive.
+int32_t mbt_jobq_wait_workers(void *queue, int32_t timeout_ms) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  int64_t deadline = mbt_now_ns() + (int64_t)timeout_ms * 1000000LL;
+  pthread_mutex_lock(&q->mu);
+  while (q->live_workers > 0) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&q->worker_exited, &q->mu);
+      continue;
+    }
+    if (mbt_now_ns() >= deadline) {
+      break;
+    }
+    struct timespec until = mbt_ns_to_timespec(deadline);
+    pthread_cond_timedwait(&q->worker_exited, &q->mu, &until);
+  }
+  int32_t live = q->live_workers;
+  pthread_mutex_unlock(&q->mu);
+  return live;
+}
+
+// Drops every queued job without running it; returns how many were dropped.
+int32_t mbt_jobq_drain(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  int32_t n = q->destroyed ? 0 : (int32_t)(mbt_jobq_total_locked(q) + mbt_jobq_slots_used(q));
+  if (!q->destroyed) {
+    mbt_jobq_drop_messages(q);
+    pthread_cond_broadcast(&q->can_send);
+  }
+  pthread_mutex_unlock(&q->mu);
+  return n;
+}
+
+int32_t mbt_jobq_len(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  int32_t n = q->destroyed ? 0 : (int32_t)(mbt_jobq_total_locked(q) + mbt_jobq_slots_used(q));
+  pthread_mutex_unlock(&q->mu);
+  return n;
+}
+
+int32_t mbt_jobq_sender_drop(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  if (q->destroyed) {
+    pthread_mutex_unlock(&q->mu);
+    return 0;
+  }
+  int dropped = 0;
+  if (q->senders > 0) {
+    q->senders--;
+    dropped = 1;
+  }
+  if (q->senders == 0) {
+    q->closed = 1;
+    pthread_cond_broadcast(&q->can_send);
+    pthread_cond_broadcast(&q->can_recv);
+  }
+  int should_cleanup = (q->senders == 0 && q->receivers == 0);
+  pthread_mutex_unlock(&q->mu);
+  if (dropped && should_cleanup) {
+    mbt_jobq_destroy(q);
+  }
+  return 0;
+}
+
+int32_t mbt_jobq_receiver_drop(void *queue) {
+  mbt_jobq *q = (mbt_jobq *)queue;
+  if (!q) {
+    return 0;
+  }
+  pthread_mutex_lock(&q->mu);
+  if (q->destroyed) {
+    pthread_mutex_unlock(&q->mu);
+    return 0;
+  }
+  int dropped = 0;
+  if (q->receivers > 0) {
+    q->receivers--;
+    dropped = 1;
+  }
+  if (q->receivers == 0) {
+    q->closed = 1;
+    mbt_jobq_drop_messages(q);
+    pthread_cond_broadcast(&q->can_send);
+    pthread_cond_broadcast(&q->can_recv);
+  }
+  int should_cleanup = (q->senders == 0 && q->receivers == 0);
+  pthread_mutex_unlock(&q->mu);
+  if (dropped && should_cleanup) {
+    mbt_jobq_destroy(q);
+  }
+  return 0;
+}
+
+typedef struct mbt_timer_slot {
+  int64_t deadline_ns;
+  int64_t period_ns;
+  int64_t seq;
+  int64_t heap_pos;
+  uint32_t gen;
+  int32_t level;
+  // A periodic job has at most one tick in the job queue or running; the
+  // slot keeps its own reference to `msg` and hands the same box out again
+  // only after the worker that ran the previous tick called `done`, so two
+  // threads never touch its refcount at once.
+  int32_t in_flight;
+  // Cancelled while in flight: released once that tick is done.
+  int32_t cancelled;
+  void *msg;
+} mbt_timer_slot;
+
+// Not a MoonBit object: the pool, its jobs and every TimerHandle share it
+// across threads. A queue is never freed; once its job queue is gone it is
+// recycled for the next pool, and slot generations keep increasing so a stale
+// TimerHandle can never cancel a timer of the new owner.
+struct mbt_timerq {
+  pthread_mutex_t mu;
+  pthread_cond_t wake;
+  pthread_t thread;
+  int started;
+  int closed;
+  mbt_jobq *jobq;
+  int64_t seq;
+  mbt_timer_slot *slots;
+  int64_t slots_len;
+  int64_t slots_cap;
+  int64_t *free_slots;
+  int64_t free_len;
+  int64_t *heap;
+  int64_t heap_len;
+  mbt_timerq *next_free;
+};
+
+static pthread_mutex_t mbt_timerq_recycle_mu = PTHREAD_MUTEX_INITIALIZER;
+static mbt_timerq *mbt_timerq_recycled = NULL;
+
+static int mbt_timer_less(mbt_timerq *tq, int64_t a, int64_t b) {
+  mbt_timer_slot *x = &tq->slots[tq->heap[a]];
+  mbt_timer_slot *y = &tq->slots[tq->heap[b]];
+  if (x->deadline_ns != y->deadline_ns) {
+    return x->deadline_ns < y->deadline_ns;
+  }
+  return x->seq < y->seq;
+}
+
+static void mbt_timer_swap(mbt_timerq *tq, int64_t a, int64_t b) {
+  int64_t sa = tq->heap[a];
+  int64_t sb = tq->heap[b];
+  tq->heap[a] = sb;
+  tq->heap[b] = sa;
+  tq->slots[sb].heap_pos = a;
+  tq->slots[sa].heap_pos = b;
+}
+
+static void mbt_timer_sift_up(mbt_timerq *tq, int64_t i) {
+  while (i > 0) {
+    int64_t parent = (i - 1) / 2;
+    if (!mbt_timer_less(tq, i, parent)) {
+      break;
+    }
+    mbt_timer_swap(tq, i, parent);
+    i = parent;
+  }
+}
+
+static void mbt_timer_sift_down(mbt_timerq *tq, int64_t i) {
+  for (;;) {
+    int64_t l = 2 * i + 1;
+    int64_t r = l + 1;
+    int64_t m = i;
+    if (l < tq->heap_len && mbt_timer_less(tq, l, m)) {
+      m = l;
+    }
+    if (r < tq->heap_len && mbt_timer_less(tq, r, m)) {
+      m = r;
+    }
+    if (m == i) {
+      break;
+    }
+    mbt_timer_swap(tq, i, m);
+    i = m;
+  }
+}
+
+static void mbt_timer_heap_push(mbt_timerq *tq, int64_t slot) {
+  int64_t i = tq->heap_len++;
+  tq->heap[i] = slot;
+  tq->slots[slot].heap_pos = i;
+  mbt_timer_sift_up(tq, i);
+}
+
+static void mbt_timer_heap_remove(mbt_timerq *tq, int64_t i) {
+  int64_t slot = tq->heap[i];
+  int64_t last = --tq->heap_len;
+  if (i != last) {
+    mbt_timer_swap(tq, i, last);
+    mbt_timer_sift_down(tq, i);
+    mbt_timer_sift_up(tq, i);
+  }
+  tq->slots[slot].heap_pos = -1;
+}
+
+static void mbt_timer_slot_free(mbt_timerq *tq, int64_t slot) {
+  tq->slots[slot].msg = NULL;
+  tq->slots[slot].heap_pos = -1;
+  tq->slots[slot].in_flight = 0;
+  tq->slots[slot].cancelled = 0;
+  tq->slots[slot].gen++;
+  tq->free_slots[tq->free_len++] = slot;
+}
+
+static int64_t mbt_timer_slot_alloc(mbt_timerq *tq) {
+  if (tq->free_len > 0) {
+    return tq->free_slots[--tq->free_len];
+  }
+  if (tq->slots_len == tq->slots_cap) {
+    int64_t new_cap = tq->slots_cap == 0 ? 16 : tq->slots_cap * 2;
+    mbt_timer_slot *slots = (mbt_timer_slot *)realloc(
+      tq->slots, (size_t)new_cap * sizeof(mbt_timer_slot)
+    );
+    if (!slots) {
+      return -1;
+    }
+    tq->slots = slots;
+    int64_t *free_slots = (int64_t *)realloc(tq->free_slots, (size_t)new_cap * sizeof(int64_t));
+    if (!free_slots) {
+      return -1;
+    }
+    tq->free_slots = free_slots;
+    int64_t *heap = (int64_t *)realloc(tq->heap, (size_t)new_cap * sizeof(int64_t));
+    if (!heap) {
+      return -1;
+    }
+    tq->heap = heap;
+    tq->slots_cap = new_cap;
+  }
+  int64_t slot = tq->slots_len++;
+  tq->slots[slot].gen = 1;
+  tq->slots[slot].heap_pos = -1;
+  tq->slots[slot].in_flight = 0;
+  tq->slots[slot].cancelled = 0;
+  tq->slots[slot].msg = NULL;
+  return slot;
+}
+
+// Removes `slot` from the schedule. The caller decrefs the returned message
+// outside the lock; NULL means there is nothing to release yet because a tick
+// is still in flight (`mbt_timerq_tick_done` releases it).
+static void *mbt_timer_slot_cancel(mbt_timerq *tq, int64_t slot) {
+  mbt_timer_slot *t = &tq->slots[slot];
+  if (t->heap_pos >= 0) {
+    mbt_timer_heap_remove(tq, t->heap_pos);
+  }
+  if (t->in_flight) {
+    t->cancelled = 1;
+    return NULL;
+  }
+  void *msg = t->msg;
+  mbt_timer_slot_free(tq, slot);
+  return msg;
+}
+
+// Tag carried by a periodic tick through the job queue: slot + 1 in the low
+// 32 bits (never 0), slot generation in the high 32.
+static int64_t mbt_timer_tag(int64_t slot, uint32_t gen) {
+  return (int64_t)(((uint64_t)gen << 32) | (uint64_t)(slot + 1));
+}
+
+static void *mbt_timerq_loop(void *arg) {
+  mbt_timerq *tq = (mbt_timerq *)arg;
+  pthread_mutex_lock(&tq->mu);
+  while (!tq->closed) {
+    if (tq->heap_len == 0) {
+      pthread_cond_wait(&tq->wake, &tq->mu);
+      continue;
+    }
+    int64_t slot = tq->heap[0];
+    mbt_timer_slot *t = &tq->slots[slot];
+    int64_t now = mbt_now_ns();
+    if (t->deadline_ns > now) {
+      struct timespec until = mbt_ns_to_timespec(t->deadline_ns);
+      pthread_cond_timedwait(&tq->wake, &tq->mu, &until);
+      continue;
+    }
+    void *msg = t->msg;
+    int32_t level = t->level;
+    int64_t tag = 0;
+    mbt_timer_heap_remove(tq, 0);
+    if (t->period_ns > 0) {
+      // Fixed rate; if we fell behind, skip missed ticks instead of bursting.
+      t->deadline_ns += t->period_ns;
+      if (t->deadline_ns <= now) {
+        t->deadline_ns = now + t->period_ns;
+      }
+      t->seq = tq->seq++;
+      mbt_timer_heap_push(tq, slot);
+      if (t->in_flight) {
+        // The previous tick has not finished: skip this one.
+        continue;
+      }
+      // Ordered after the previous tick's worker released the box: that
+      // worker cleared `in_flight` under `mu` after its last use.
+      t->in_flight = 1;
+      tag = mbt_timer_tag(slot, t->gen);
+      moonbit_incref(msg);
+    } else {
+      mbt_timer_slot_free(tq, slot);
+    }
+    pthread_mutex_unlock(&tq->mu);
+    mbt_jobq_push(tq->jobq, level, msg, 0, tag);
+    pthread_mutex_lock(&tq->mu);
+  }
+  pthread_mutex_unlock(&tq->mu);
+  return NULL;
+}
+
+// Called by `mbt_jobq_done` on the worker that just finished the tick tagged
+// `tag`, after the job's MoonBit references to it are gone.
+static void mbt_timerq_tick_done(mbt_timerq *tq, int64_t tag) {
+  int64_t slot = (tag & 0xffffffff) - 1;
+  uint32_t gen = (uint32_t)((uint64_t)tag >> 32);
+  void *release = NULL;
+  pthread_mutex_lock(&tq->mu);
+  mbt_timer_slot *t = slot < tq->slots_len ? &tq->slots[slot] : NULL;
+  if (t && t->gen == gen && t->in_flight) {
+    t->in_flight = 0;
+    if (t->cancelled) {
+      release = t->msg;
+      mbt_timer_slot_free(tq, slot);
+    }
+  }
+  pthread_mutex_unlock(&tq->mu);
+  if (release) {
+    moonbit_decref(release);
+  }
+}
+
+int32_t mbt_timerq_close(void *timers) {
+  mbt_timerq *tq = (mbt_timerq *)timers;
+  pthread_mutex_lock(&tq->mu);
+  if (tq->closed) {
+    pthread_mutex_unlock(&tq->mu);
+    return 0;
+  }
+  tq->closed = 1;
+  int started = tq->started;
+  pthread_cond_broadcast(&tq->wake);
+  pthread_mutex_unlock(&tq->mu);
+  if (started) {
+    pthread_join(tq->thread, NULL);
+  }
+  pthread_mutex_lock(&tq->mu);
+  while (tq->heap_len > 0) {
+    void *msg = mbt_timer_slot_cancel(tq, tq->heap[0]);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+  }
+  mbt_jobq *jobq = tq->jobq;
+  pthread_mutex_unlock(&tq->mu);
+  if (jobq) {
+    mbt_jobq_sender_drop(jobq);
+  }
+  return 0;
+}
+
+// Called when the owning job queue is destroyed: every worker is gone, so
+// ticks that never reported `done` (dropped unrun) can be released here.
+static void mbt_timerq_release(mbt_timerq *tq) {
+  pthread_mutex_lock(&tq->mu);
+  tq->heap_len = 0;
+  for (int64_t i = 0; i < tq->slots_len; i++) {
+    mbt_timer_slot *t = &tq->slots[i];
+    if (t->msg) {
+      moonbit_decref(t->msg);
+      mbt_timer_slot_free(tq, i);
+    }
+  }
+  tq->jobq = NULL;
+  pthread_mutex_unlock(&tq->mu);
+  pthread_mutex_lock(&mbt_timerq_recycle_mu);
+  tq->next_free = mbt_timerq_recycled;
+  mbt_timerq_recycled = tq;
+  pthread_mutex_unlock(&mbt_timerq_recycle_mu);
+}
+
+int32_t mbt_timerq_new2(void *queue, void **out_box) {
+  if (!out_box) {
+    return 0;
+  }
+  mbt_jobq *q = (mbt_jobq *)queue;
+  pthread_mutex_lock(&mbt_timerq_recycle_mu);
+  mbt_timerq *tq = mbt_timerq_recycled;
+  if (tq) {
+    mbt_timerq_recycled = tq->next_free;
+  }
+  pthread_mutex_unlock(&mbt_timerq_recycle_mu);
+  if (!tq) {
+    tq = (mbt_timerq *)calloc(1, sizeof(mbt_timerq));
+    if (!tq) {
+      return 0;
+    }
+    pthread_mutex_init(&tq->mu, NULL);
+    mbt_cond_init_clock(&tq->wake);
+  }
+  pthread_mutex_lock(&q->mu);
+  int attached = !q->destroyed && !q->timers;
+  if (attached) {
+    q->senders++;
+    q->timers = tq;
+  }
+  pthread_mutex_unlock(&q->mu);
+  pthread_mutex_lock(&tq->mu);
+  tq->started = 0;
+  tq->closed = !attached;
+  tq->jobq = attached ? q : NULL;
+  tq->next_free = NULL;
+  pthread_mutex_unlock(&tq->mu);
+  if (!attached) {
+    mbt_timerq_release(tq);
+    return 0;
+  }
+  out_box[0] = tq;
+  return 1;
+}
+
+int64_t mbt_timerq_schedule(
+  void *timers,
+  int32_t delay_ms,
+  int32_t period_ms,
+  int32_t level,
+  void *msg
+) {
+  mbt_timerq *tq = (mbt_timerq *)timers;
+  if (level < 0 || level >= MBT_JOBQ_LEVELS) {
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  pthread_mutex_lock(&tq->mu);
+  int64_t slot = tq->closed ? -1 : mbt_timer_slot_alloc(tq);
+  if (slot < 0) {
+    pthread_mutex_unlock(&tq->mu);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 0;
+  }
+  if (!tq->started) {
+    if (pthread_create(&tq->thread, NULL, mbt_timerq_loop, tq) != 0) {
+      mbt_timer_slot_free(tq, slot);
+      pthread_mutex_unlock(&tq->mu);
+      if (msg) {
+        moonbit_decref(msg);
+      }
+      return 0;
+    }
+    tq->started = 1;
+  }
+  mbt_timer_slot *t = &tq->slots[slot];
+  int64_t delay_ns = (int64_t)(delay_ms < 0 ? 0 : delay_ms) * 1000000LL;
+  t->deadline_ns = mbt_now_ns() + delay_ns;
+  t->period_ns = period_ms > 0 ? (int64_t)period_ms * 1000000LL : 0;
+  t->seq = tq->seq++;
+  t->level = level;
+  t->msg = msg;
+  mbt_timer_heap_push(tq, slot);
+  int64_t id = ((int64_t)t->gen << 32) | slot;
+  if (t->heap_pos == 0) {
+    pthread_cond_signal(&tq->wake);
+  }
+  pthread_mutex_unlock(&tq->mu);
+  return id;
+}
+
+int32_t mbt_timerq_cancel(void *timers, int64_t id) {
+  mbt_timerq *tq = (mbt_timerq *)timers;
+  int64_t slot = id & 0xffffffffLL;
+  uint32_t gen = (uint32_t)(id >> 32);
+  pthread_mutex_lock(&tq->mu);
+  if (slot < tq->slots_len && tq->slots[slot].gen == gen && tq->slots[slot].heap_pos >= 0) {
+    void *msg = mbt_timer_slot_cancel(tq, slot);
+    pthread_mutex_unlock(&tq->mu);
+    if (msg) {
+      moonbit_decref(msg);
+    }
+    return 1;
+  }
+  pthread_mutex_unlock(&tq->mu);
+  return 0;
+}
+
+// Cancellation flag shared by every job polling it, so it lives outside
+// MoonBit RC: `refs` counts token handles (`new`/`clone` minus `destroy`).
+typedef struct mbt_cancel {
+  atomic_int cancelled;
+  atomic_int refs;
+} mbt_cancel;
+
+void *mbt_cancel_new(void) {
+  mbt_cancel *c = (mbt_cancel *)malloc(sizeof(mbt_cancel));
+  if (!c) {
+    return NULL;
+  }
+  atomic_init(&c->cancelled, 0);
+  atomic_init(&c->refs, 1);
+  return c;
+}
+
+int32_t mbt_cancel_retain(void *cancel) {
+  mbt_cancel *c = (mbt_cancel *)cancel;
+  atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+  return 0;
+}
+
+int32_t mbt_cancel_release(void *cancel) {
+  mbt_cancel *c = (mbt_cancel *)cancel;
+  if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) == 1) {
+    free(c);
+  }
+  return 0;
+}
+
+int32_t mbt_cancel_new2(void **out_box) {
+  if (!out_box) {
+    return 0;
+  }
+  void *c = mbt_cancel_new();
+  out_box[0] = c;
+  return c != NULL;
+}
+
+int32_t mbt_cancel_set(void *cancel) {
+  mbt_cancel *c = (mbt_cancel *)cancel;
+  return atomic_exchange_explicit(&c->cancelled, 1, memory_order_release) == 0;
+}
+
+int32_t mbt_cancel_is_set(void *cancel) {
+  mbt_cancel *c = (mbt_cancel *)cancel;
+  return atomic_load_explicit(&c->cancelled, memory_order_acquire);
+}
+
+// Shared running minimum, used by `par_find_first` / `par_position` to
+// publish the lowest matching index found so far. Workers update it
+// concurrently, so it lives outside MoonBit RC and is freed by the caller
+// once every job of the search has finished.
+typedef struct mbt_min_cell {
+  atomic_int value;
+} mbt_min_cell;
+
+int32_t mbt_min_cell_new2(int32_t init, void **out_box) {
+  if (!out_box) {
+    return 0;
+  }
+  mbt_min_cell *c = (mbt_min_cell *)malloc(sizeof(mbt_min_cell));
+  out_box[0] = c;
+  if (!c) {
+    return 0;
+  }
+  atomic_init(&c->value, init);
+  return 1;
+}
+
+int32_t mbt_min_cell_free(void *cell) {
+  free(cell);
+  return 0;
+}
+
+// Lowers the cell to `v` if `v` is smaller; returns 1 if it did.
+int32_t mbt_min_cell_update(void *cell, int32_t v) {
+  mbt_min_cell *c = (mbt_min_cell *)cell;
+  int cur = atomic_load_explicit(&c->value, memory_order_relaxed);
+  while (v < cur) {
+    if (atomic_compare_exchange_weak_explicit(
+          &c->value, &cur, v, memory_order_release, memory_order_relaxed
+        )) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int32_t mbt_min_cell_get(void *cell) {
+  mbt_min_cell *c = (mbt_min_cell *)cell;
+  return atomic_load_explicit(&c->value, memory_order_acquire);
+}
+
+int64_t mbt_clock_ns(void) {
+  return mbt_now_ns();
+}
+
+// Adaptive chunk size for `ParConfig::auto`. Workers report how long a chunk
+// took; the tuner keeps an EWMA of the per-item cost (ns * 256) and derives
+// the chunk length that should take `target_ns`, changing by at most 2x per
+// sample. Updates race benignly: a lost sample only delays convergence.
+// Jobs on every worker read it, so it lives outside MoonBit RC; it belongs to
+// the pool it was made for and is freed with that pool's job queue.
+struct mbt_tuner {
+  atomic_llong item_cost_q8;
+  atomic_int chunk;
+  int32_t min_chunk;
+  int32_t max_chunk;
+  int64_t target_ns;
+  mbt_tuner *next;
+};
+
+static void mbt_tuners_free(mbt_tuner *t) {
+  while (t) {
+    mbt_tuner *next = t->next;
+    free(t);
+    t = next;
+  }
+}
+
+int32_t mbt_tuner_new2(
+  void *queue,
+  int32_t init_chunk,
+  int32_t min_chunk,
+  int32_t max_chunk,
+  int64_t target_ns,
+  void **out_box
+) {
+  if (!out_box) {
+    return 0;
+  }
+  mbt_jobq *q = (mbt_jobq *)queue;
+  mbt_tuner *t = (mbt_tuner *)malloc(sizeof(mbt_tuner));
+  out_box[0] = t;
+  if (!t) {
+    return 0;
+  }
+  t->min_chunk = min_chunk < 1 ? 1 : min_chunk;
+  t->max_chunk = max_chunk < t->min_chunk ? t->min_chunk : max_chunk;
+  t->target_ns = target_ns < 1 ? 1 : target_ns;
+  if (init_chunk < t->min_chunk) {
+    init_chunk = t->min_chunk;
+  }
+  if (init_chunk > t->max_chunk) {
+    init_chunk = t->max_chunk;
+  }
+  atomic_init(&t->item_cost_q8, 0);
+  atomic_init(&t->chunk, init_chunk);
+  pthread_mutex_lock(&q->mu);
+  int attached = !q->destroyed;
+  if (attached) {
+    t->next = q->tuners;
+    q->tuners = t;
+  }
+  pthread_mutex_unlock(&q->mu);
+  if (!attached) {
+    free(t);
+    out_box[0] = NULL;
+  }
+  return attached;
+}
+
+int32_t mbt_tuner_chunk(void *tuner) {
+  mbt_tuner *t = (mbt_tuner *)tuner;
+  return atomic_load_explicit(&t->chunk, memory_order_relaxed);
+}
+
+int32_t mbt_tuner_record(void *tuner, int32_t items, int64_t elapsed_ns) {
+  mbt_tuner *t = (mbt_tuner *)tuner;
+  if (items <= 0 || elapsed_ns < 0) {
+    return 0;
+  }
+  int64_t sample = elapsed_ns * 256 / items;
+  if (sample < 1) {
+    sample = 1;
+  }
+  int64_t cost = atomic_load_explicit(&t->item_cost_q8, memory_order_relaxed);
+  cost = cost == 0 ? sample : (cost * 3 + sample) / 4;
+  atomic_store_explicit(&t->item_cost_q8, cost, memory_order_relaxed);
+  int64_t cur = atomic_load_explicit(&t->chunk, memory_order_relaxed);
+  int64_t want = t->target_ns * 256 / cost;
+  if (want > cur * 2) {
+    want = cur * 2;
+  }
+  if (want < cur / 2) {
+    want = cur / 2;
+  }
+  if (want < t->min_chunk) {
+    want = t->min_chunk;
+  }
+  if (want > t->max_chunk) {
+    want = t->max_chunk;
+  }
+  atomic_store_explicit(&t->chunk, (int32_t)want, memory_order_relaxed);
+  return 0;
+}
+
+// Numeric kernels behind `par_sum` / `par_dot` / `par_min_max` /
+// `par_histogram`, each over `xs[lo:hi]` of a FixedArray. Sums and dot
+// products keep four independent accumulators so the loop has no serial
+// dependency and vectorises without reassociating floating point. Integer
+// kernels accumulate unsigned, so overflow wraps like MoonBit arithmetic.
+#define MBT_KERNELS(SUF, T, ACC)                                              \
+  T mbt_kernel_sum_##SUF(const T *xs, int32_t lo, int32_t hi) {               \
+    ACC a0 = 0, a1 = 0, a2 = 0, a3 = 0;                                       \
+    int32_t i = lo;                                                           \
+    for (; i + 4 <= hi; i += 4) {                                             \
+      a0 += (ACC)xs[i];                                                       \
+      a1 += (ACC)xs[i + 1];                                                   \
+      a2 += (ACC)xs[i + 2];                                                   \
+      a3 += (ACC)xs[i + 3];                                                   \
+    }                                                                         \
+    for (; i < hi; i++) {                                                     \
+      a0 += (ACC)xs[i];                                                       \
+    }                                                                         \
+    return (T)((a0 + a1) + (a2 + a3));                                        \
+  }                                                                           \
+                                                                              \
+  T mbt_kernel_dot_##SUF(const T *xs, const T *ys, int32_t lo, int32_t hi) {  \
+    ACC a0 = 0, a1 = 0, a2 = 0, a3 = 0;                                       \
+    int32_t i = lo;                                                           \
+    for (; i + 4 <= hi; i += 4) {                                             \
+      a0 += (ACC)xs[i] * (ACC)ys[i];                                          \
+      a1 += (ACC)xs[i + 1] * (ACC)ys[i + 1];                                  \
+      a2 += (ACC)xs[i + 2] * (ACC)ys[i + 2];                                  \
+      a3 += (ACC)xs[i + 3] * (ACC)ys[i + 3];                                  \
+    }                                                                         \
+    for (; i < hi; i++) {                                                     \
+      a0 += (ACC)xs[i] * (ACC)ys[i];                                          \
+    }                                                                         \
+    return (T)((a0 + a1) + (a2 + a3));                                        \
+  }                                                                           \
+                                                                              \
+  /* Writes min and max of a non-empty range to out[0] and out[1]. */         \
+  void mbt_kernel_min_max_##SUF(const T *xs, int32_t lo, int32_t hi, T *out) { \
+    T mn = xs[lo], mx = xs[lo];                                               \
+    for (int32_t i = lo + 1; i < hi; i++) {                                   \
+      T x = xs[i];                                                            \
+      mn = x < mn ? x : mn;                                                   \
+      mx = x > mx ? x : mx;                                                   \
+    }                                                                         \
+    out[0] = mn;                                                              \
+    out[1] = mx;                                                              \
+  }
+
+MBT_KERNELS(f64, double, double)
+MBT_KERNELS(i32, int32_t, uint32_t)
+MBT_KERNELS(u64, uint64_t, uint64_t)
+
+// Histograms add the elements of `xs[lo:hi]` that lie in [min, max] to
+// `counts`, split into `bins` equal-width buckets (`max` lands in the last
+// one). Out-of-range elements and NaN are skipped. Callers ensure bins > 0
+// and min <= max.
+void mbt_kernel_hist_f64(
+  const double *xs,
+  int32_t lo,
+  int32_t hi,
+  double min,
+  double max,
+  int32_t *counts,
+  int32_t bins
+) {
+  double scale = max > min ? (double)bins / (max - min) : 0.0;
+  for (int32_t i = lo; i < hi; i++) {
+    double x = xs[i];
+    if (x >= min && x <= max) {
+      int32_t b = (int32_t)((x - min) * scale);
+      counts[b < bins ? b : bins - 1]++;
+    }
+  }
+}
+
+void mbt_kernel_hist_i32(
+  const int32_t *xs,
+  int32_t lo,
+  int32_t hi,
+  int32_t min,
+  int32_t max,
+  int32_t *counts,
+  int32_t bins
+) {
+  int64_t width = (int64_t)max - min + 1;
+  for (int32_t i = lo; i < hi; i++) {
+    int32_t x = xs[i];
+    if (x >= min && x <= max) {
+      counts[((int64_t)x - min) * bins / width]++;
+    }
+  }
+}
+
+void mbt_kernel_hist_u64(
+  const uint64_t *xs,
+  int32_t lo,
+  int32_t hi,
+  uint64_t min,
+  uint64_t max,
+  int32_t *counts,
+  int32_t bins
+) {
+  for (int32_t i = lo; i < hi; i++) {
+    uint64_t x = xs[i];
+    if (x >= min && x <= max) {
+#ifdef __SIZEOF_INT128__
+      unsigned __int128 width = (unsigned __int128)(max - min) + 1;
+      counts[(int32_t)((unsigned __int128)(x - min) * bins / width)]++;
+#else
+      long double width = (long double)(max - min) + 1.0L;
+      int32_t b = (int32_t)((long double)(x - min) * bins / width);
+      counts[b < bins ? b : bins - 1]++;
+#endif
+    }
+  }
+}
+
+static int32_t mbt_parse_cpulist(const char *s, int32_t *out, int32_t cap) {
+  int32_t n = 0;
+  while (*s) {
+    char *end;
+    long lo = strtol(s, &end, 10);
+    if (end == s) {
+      break;
+    }
+    long hi = lo;
+    s = end;
+    if (*s == '-') {
+      s++;
+      hi = strtol(s, &end, 10);
+      if (end == s) {
+        break;
+      }
+      s = end;
+    }
+    for (long cpu = lo; cpu <= hi; cpu++) {
+      if (n < cap) {
+        out[n] = (int32_t)cpu;
+      }
+      n++;
+    }
+    if (*s != ',') {
+      break;
+    }
+    s++;
+  }
+  return n;
+}
+
+int32_t mbt_numa_max_node(void) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (!dir) {
+    return -1;
+  }
+  int32_t max_node = -1;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    const char *name = ent->d_name;
+    if (strncmp(name, "node", 4) != 0 || name[4] < '0' || name[4] > '9') {
+      continue;
+    }
+    int32_t id = (int32_t)strtol(name + 4, NULL, 10);
+    if (id > max_node) {
+      max_node = id;
+    }
+  }
+  closedir(dir);
+  return max_node;
+}
+
+int32_t mbt_numa_node_cpus(int32_t node, int32_t *out, int32_t cap) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  char line[4096];
+  if (!fgets(line, sizeof(line), f)) {
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+  return mbt_parse_cpulist(line, out, cap);
+}
+
+int32_t mbt_affinity_set_self(int32_t *cpus, int32_t n) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int32_t added = 0;
+  for (int32_t i = 0; i < n; i++) {
+    if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+      CPU_SET(cpus[i], &set);
+      added++;
+    }
+  }
+  if (added == 0) {
+    return 0;
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  (void)n;
+  return 0;
+#endif
+}
+
+int32_t mbt_affinity_get_self(int32_t *out, int32_t cap) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    return -1;
+  }
+  int32_t n = 0;
+  for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      if (n < cap) {
+        out[n] = cpu;
+      }
+      n++;
+    }
+  }
+  return n;
+#else
+  (void)out;
+  (void)cap;
+  return -1;
+#endif
+}